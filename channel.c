@@ -0,0 +1,326 @@
+#include <pthread.h>
+#include <rf24c.h> // rf24 stuff
+#include <stdint.h> // uint8_t
+#include <stdio.h> // fprintf()
+#include <string.h> // memcpy()
+#include <time.h> // nanosleep()
+
+#include <opts.h>
+
+#include "channel.h"
+
+/* channel manager.
+ *
+ * every CHAN_REPORT_MS both nodes tell the other which channels they think
+ * the links are on, how their own transmissions went since the last report
+ * and how busy each channel in CHAN_SET looked to their receiving radio. that
+ * radio samples the RPD on one channel every CHAN_SCAN_MS while it has
+ * nothing else to do.
+ *
+ * the base station makes the decisions. when the retries on a link climb it
+ * picks the quietest channel as seen by that link's receiver and announces
+ * the new pair on the old channels. the mobile unit answers with a report
+ * carrying the new pair, still on the old channels, and moves. the base
+ * station moves when it gets that answer, or after CHAN_ANNOUNCE reports
+ * without one. a node that hears nothing for CHAN_LOST_MS goes back to
+ * UPLINK_CHANNEL and DOWNLINK_CHANNEL, and so will the other.
+ *
+ *   0      1  2-3     4       5         6-7   8-9      10-11     12-
+ *   magic  0  length  uplink  downlink  sent  retries  failures  noise
+ */
+
+#define CHAN_HDR_LEN	12
+#define CHAN_SET_LEN	sizeof(chan_set)
+
+#define CHAN_REPORT_MS	1000
+#define CHAN_SCAN_MS	50
+#define CHAN_LOST_MS	3500
+#define CHAN_HOLD_MS	5000	/* least time on a channel pair before moving again */
+#define CHAN_ANNOUNCE	3	/* reports a move is announced in before we make it anyway */
+#define CHAN_MIN_SENT	50	/* fragments in a report needed to judge a link */
+#define CHAN_BAD_RETRIES	2	/* average per fragment */
+#define CHAN_BAD_FAILURES	20	/* one fragment in this many lost */
+
+struct chan_stats {
+	uint16_t sent;
+	uint16_t retries;
+	uint16_t failures;
+};
+
+static const uint8_t chan_set[] = CHAN_SET;
+
+static pthread_mutex_t chan_lock = PTHREAD_MUTEX_INITIALIZER;
+static void (*chan_send)(uint8_t *packet, size_t size);
+
+static uint8_t uplink = UPLINK_CHANNEL;
+static uint8_t downlink = DOWNLINK_CHANNEL;
+static uint8_t noise[sizeof(chan_set)];	/* busy samples, as a fraction of 255 */
+static uint8_t sampled[sizeof(chan_set)];
+static struct chan_stats own;		/* since our last report */
+static uint64_t last_heard, last_move, last_scan;
+static size_t scan_next;
+
+#ifdef BASE_STATION
+static uint8_t peer_noise[sizeof(chan_set)];
+static struct chan_stats peer;
+static uint8_t next_up, next_down;
+static int announcing;	/* reports left before we move to next_up/next_down */
+#endif
+
+/* only the radio threads touch these. */
+static uint8_t rx_applied = RX_CHANNEL;
+static uint8_t tx_applied = TX_CHANNEL;
+
+/* called with chan_lock held. */
+static uint8_t rx_channel(void) {
+#ifdef BASE_STATION
+	return uplink;
+#else
+	return downlink;
+#endif
+}
+
+/* called with chan_lock held. */
+static uint8_t tx_channel(void) {
+#ifdef BASE_STATION
+	return downlink;
+#else
+	return uplink;
+#endif
+}
+
+/* called with chan_lock held. */
+static void move_to(uint8_t up, uint8_t down) {
+	if (up == uplink && down == downlink)
+		return;
+	pr("channels: uplink %d -> %d, downlink %d -> %d\n", uplink, up, downlink, down);
+	uplink = up;
+	downlink = down;
+	last_move = now_ms();
+}
+
+#ifdef BASE_STATION
+static int link_bad(const struct chan_stats *st) {
+	if (st->sent < CHAN_MIN_SENT)
+		return 0;
+	return st->retries > st->sent * CHAN_BAD_RETRIES
+		|| st->failures * CHAN_BAD_FAILURES > st->sent;
+}
+
+/* called with chan_lock held. never one of the channels in use now, and
+ * not taken either, or the channel a link just left could come straight
+ * back. returns current if there is no other choice.
+ */
+static uint8_t quietest(const uint8_t *scores, uint8_t current, uint8_t taken) {
+	size_t best = CHAN_SET_LEN;
+	for (size_t i = 0; i < CHAN_SET_LEN; ++i) {
+		if (chan_set[i] == uplink || chan_set[i] == downlink || chan_set[i] == taken)
+			continue;
+		if (best == CHAN_SET_LEN || scores[i] < scores[best])
+			best = i;
+	}
+	return best == CHAN_SET_LEN ? current : chan_set[best];
+}
+
+/* called with chan_lock held. the downlink is judged by our own retries and
+ * the mobile unit's scan, the uplink the other way around.
+ */
+static int decide(uint8_t *up, uint8_t *down) {
+	*up = uplink;
+	*down = downlink;
+	if (now_ms() - last_move >= CHAN_HOLD_MS) {
+		if (link_bad(&own))
+			*down = quietest(peer_noise, downlink, uplink);
+		if (link_bad(&peer))
+			*up = quietest(noise, uplink, *down);
+	}
+	memset(&peer, 0, sizeof(peer));
+	return *up != uplink || *down != downlink;
+}
+#endif
+
+static size_t make_message(uint8_t *msg, uint8_t up, uint8_t down) {
+	size_t len = CHAN_HDR_LEN + CHAN_SET_LEN;
+
+	msg[0] = CHAN_MAGIC;
+	msg[1] = 0;
+	msg[2] = len >> 8;
+	msg[3] = len;
+	msg[4] = up;
+	msg[5] = down;
+	msg[6] = own.sent >> 8;
+	msg[7] = own.sent;
+	msg[8] = own.retries >> 8;
+	msg[9] = own.retries;
+	msg[10] = own.failures >> 8;
+	msg[11] = own.failures;
+	memcpy(msg + CHAN_HDR_LEN, noise, CHAN_SET_LEN);
+	return len;
+}
+
+static int sample(RF24Handle radio, uint8_t channel) {
+	struct timespec settle = {0, 200000}; // 130 µs into RX, 40 µs for the RPD
+
+	rf24_stopListening(radio);
+	rf24_setChannel(radio, channel);
+	rf24_startListening(radio);
+	nanosleep(&settle, NULL);
+	int busy = rf24_isPVariant(radio) ? rf24_testRPD(radio) : rf24_testCarrier(radio);
+	rf24_stopListening(radio);
+	rf24_setChannel(radio, rx_applied);
+	rf24_startListening(radio);
+	return busy;
+}
+
+void chan_init(void (*send)(uint8_t *packet, size_t size)) {
+	chan_send = send;
+	last_heard = last_move = now_ms();
+	/* a channel we know nothing about is not a quiet one */
+	memset(noise, 255, sizeof(noise));
+#ifdef BASE_STATION
+	memset(peer_noise, 255, sizeof(peer_noise));
+#endif
+}
+
+void *chan_run(void *argument) {
+	(void) argument;
+	struct timespec period = {CHAN_REPORT_MS / 1000, (CHAN_REPORT_MS % 1000) * 1000000};
+	uint8_t msg[CHAN_HDR_LEN + sizeof(chan_set)];
+
+	while (1) {
+		nanosleep(&period, NULL);
+
+		pthread_mutex_lock(&chan_lock);
+		if (now_ms() - last_heard > CHAN_LOST_MS) {
+			pr("channels: lost the other side\n");
+			move_to(UPLINK_CHANNEL, DOWNLINK_CHANNEL);
+			last_heard = now_ms();
+#ifdef BASE_STATION
+			announcing = 0;
+#endif
+		}
+		uint8_t up = uplink;
+		uint8_t down = downlink;
+#ifdef BASE_STATION
+		if (!announcing && decide(&next_up, &next_down))
+			announcing = CHAN_ANNOUNCE;
+		if (announcing) {
+			up = next_up;
+			down = next_down;
+		}
+#endif
+		size_t len = make_message(msg, up, down);
+		memset(&own, 0, sizeof(own));
+		pthread_mutex_unlock(&chan_lock);
+
+		chan_send(msg, len);
+
+#ifdef BASE_STATION
+		/* no answer, but the mobile unit most likely heard one of
+		 * them. if not, we both end up on the rendezvous channels.
+		 */
+		pthread_mutex_lock(&chan_lock);
+		if (announcing && --announcing == 0)
+			move_to(next_up, next_down);
+		pthread_mutex_unlock(&chan_lock);
+#endif
+	}
+}
+
+void chan_input(uint8_t *packet, size_t size) {
+	if (size < CHAN_HDR_LEN + CHAN_SET_LEN)
+		return;
+
+	pthread_mutex_lock(&chan_lock);
+	last_heard = now_ms();
+#ifdef BASE_STATION
+	if (announcing && packet[4] == next_up && packet[5] == next_down) {
+		/* the answer to our announcement, the mobile unit has moved */
+		announcing = 0;
+		move_to(next_up, next_down);
+		pthread_mutex_unlock(&chan_lock);
+		return;
+	}
+	peer.sent = (packet[6] << 8) | packet[7];
+	peer.retries = (packet[8] << 8) | packet[9];
+	peer.failures = (packet[10] << 8) | packet[11];
+	memcpy(peer_noise, packet + CHAN_HDR_LEN, CHAN_SET_LEN);
+	pthread_mutex_unlock(&chan_lock);
+#else
+	uint8_t up = packet[4];
+	uint8_t down = packet[5];
+	if (up > 125 || down > 125 || up == down || (up == uplink && down == downlink)) {
+		pthread_mutex_unlock(&chan_lock);
+		return;
+	}
+
+	/* answer on the old channels before leaving them */
+	uint8_t msg[CHAN_HDR_LEN + sizeof(chan_set)];
+	size_t len = make_message(msg, up, down);
+	pthread_mutex_unlock(&chan_lock);
+	chan_send(msg, len);
+
+	pthread_mutex_lock(&chan_lock);
+	move_to(up, down);
+	pthread_mutex_unlock(&chan_lock);
+#endif
+}
+
+void chan_poll_rx(RF24Handle radio) {
+	uint64_t now = now_ms();
+	size_t scan = CHAN_SET_LEN;
+
+	pthread_mutex_lock(&chan_lock);
+	uint8_t want = rx_channel();
+	if (now - last_scan >= CHAN_SCAN_MS) {
+		last_scan = now;
+		scan = scan_next;
+		scan_next = (scan_next + 1) % CHAN_SET_LEN;
+		/* our own links would only show up as noise */
+		if (chan_set[scan] == uplink || chan_set[scan] == downlink)
+			scan = CHAN_SET_LEN;
+	}
+	pthread_mutex_unlock(&chan_lock);
+
+	if (want != rx_applied) {
+		rf24_stopListening(radio);
+		rf24_setChannel(radio, want);
+		rf24_startListening(radio);
+		rx_applied = want;
+	}
+
+	if (scan == CHAN_SET_LEN || rf24_available(radio))
+		return;
+	int busy = sample(radio, chan_set[scan]);
+
+	pthread_mutex_lock(&chan_lock);
+	if (!sampled[scan]) {
+		noise[scan] = busy ? 255 : 0;
+		sampled[scan] = 1;
+	} else {
+		noise[scan] = noise[scan] - noise[scan] / 8 + (busy ? 255 / 8 : 0);
+	}
+	pthread_mutex_unlock(&chan_lock);
+}
+
+void chan_poll_tx(RF24Handle radio) {
+	pthread_mutex_lock(&chan_lock);
+	uint8_t want = tx_channel();
+	pthread_mutex_unlock(&chan_lock);
+
+	if (want != tx_applied) {
+		rf24_setChannel(radio, want);
+		tx_applied = want;
+	}
+}
+
+void chan_tx_done(RF24Handle radio, int success) {
+	uint8_t retries = rf24_getARC(radio);
+
+	pthread_mutex_lock(&chan_lock);
+	own.sent++;
+	own.retries += retries;
+	if (!success)
+		own.failures++;
+	pthread_mutex_unlock(&chan_lock);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <rf24c.h> // RF24Handle
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t
+
+/* the first byte of a channel manager message, see pep.h. */
+#define CHAN_MAGIC	0xf1
+
+#define chan_is_message(packet)	((packet)[0] == CHAN_MAGIC)
+
+void chan_init(void (*send)(uint8_t *packet, size_t size));
+void *chan_run(void *argument);
+void chan_input(uint8_t *packet, size_t size);
+
+/* the radio threads call these, so that only they touch their radio. */
+void chan_poll_rx(RF24Handle radio);
+void chan_poll_tx(RF24Handle radio);
+void chan_tx_done(RF24Handle radio, int success);
@@ -1,3 +1,6 @@
+#include <stdint.h> // uint64_t
+#include <time.h> // clock_gettime()
+
 #define UPLINK_CHANNEL 111
 #define DOWNLINK_CHANNEL 109
 
@@ -6,3 +9,64 @@
 
 #define TX_CE_PIN 27
 #define TX_CSN_PIN 10
+
+#define MTU 1500
+#define DATA_SIZE 31 /* per fragment, the first byte is the fragment number */
+
+/* packet CRC: check each reassembled packet with a CRC-32C sent after it,
+ * and cut the radio's per-frame CRC from 16 to 8 bits. it cannot go
+ * entirely, the auto-ack needs it.
+ */
+#define PACKET_CRC	0
+#define CRC_TRAILER	(PACKET_CRC ? 4 : 0)
+
+/* channel manager: score the channels in CHAN_SET from RPD samples and
+ * retry counts, and let the base station move the links to quieter ones.
+ * UPLINK_CHANNEL and DOWNLINK_CHANNEL are where both sides start and where
+ * they meet again when they lose each other.
+ */
+#define CHANNEL_MANAGER	0
+#define CHAN_SET	{100, 103, 106, 109, 111, 114, 117, 120, 123}
+
+/* TDMA: one radio per node carries both directions on TDMA_CHANNEL, in
+ * frames the base station lays out from the backlog on both sides. the TX
+ * radio is left alone. cannot be combined with CHANNEL_MANAGER.
+ */
+#define TDMA		0
+#define TDMA_CHANNEL	UPLINK_CHANNEL
+
+/* split-TCP: terminate TCP connections entering tun0 locally and carry
+ * the byte streams over the radio with pep.c instead of end-to-end TCP.
+ * needs the REDIRECT rules in the setup scripts (SPLIT_TCP=1 there too).
+ */
+#define SPLIT_TCP	0
+#define PEP_PORT	5555	/* where iptables redirects intercepted TCP */
+#define PEP_MARK	0x24	/* fwmark on the proxy's own sockets */
+
+#define PRINT		0	/* enable/disable prints. */
+
+/* the funny do-while next clearly performs one iteration of the loop.
+ * if you are really curious about why there is a loop, please check
+ * the course book about the C preprocessor where it is explained. it
+ * is to avoid bugs and/or syntax errors in case you use the pr in an
+ * if-statement without { }.
+ *
+ */
+
+#if PRINT
+#define pr(...)		do { fprintf(stderr, __VA_ARGS__); } while (0)
+#else
+#define pr(...)		/* no effect at all */
+#endif
+
+static inline uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,90 @@
+#include <pthread.h> // pthread_once()
+#include <stdint.h> // uint32_t
+#include <string.h> // memcpy()
+
+#if defined(__x86_64__)
+#include <nmmintrin.h> // _mm_crc32_u64()
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h> // __crc32cw()
+#endif
+
+#include "crc32c.h"
+
+/* CRC-32C with the CPU's CRC instructions where there are any and a table
+ * otherwise. on x86 SSE4.2 is looked for at run time, so the binary does not
+ * need special flags. on ARM the CRC extension is only used when the compiler
+ * targets it, e.g. with -march=armv8-a+crc for a Pi 3 or newer.
+ */
+
+#define CRC32C_POLY	0x82f63b78	/* reflected */
+
+static uint32_t table[256];
+static uint32_t (*update)(uint32_t crc, const uint8_t *data, size_t len);
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static uint32_t update_table(uint32_t crc, const uint8_t *data, size_t len) {
+	while (len--)
+		crc = table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t update_hw(uint32_t crc, const uint8_t *data, size_t len) {
+	uint64_t crc64 = crc;
+	for (; len >= 8; data += 8, len -= 8) {
+		uint64_t word;
+		memcpy(&word, data, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = crc64;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *data++);
+	return crc;
+}
+
+static int have_hw(void) {
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t update_hw(uint32_t crc, const uint8_t *data, size_t len) {
+#if defined(__aarch64__)
+	for (; len >= 8; data += 8, len -= 8) {
+		uint64_t word;
+		memcpy(&word, data, sizeof(word));
+		crc = __crc32cd(crc, word);
+	}
+#else
+	for (; len >= 4; data += 4, len -= 4) {
+		uint32_t word;
+		memcpy(&word, data, sizeof(word));
+		crc = __crc32cw(crc, word);
+	}
+#endif
+	while (len--)
+		crc = __crc32cb(crc, *data++);
+	return crc;
+}
+#endif
+
+static void init(void) {
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; ++bit)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		table[i] = crc;
+	}
+
+	update = update_table;
+#if defined(__x86_64__)
+	if (have_hw())
+		update = update_hw;
+#elif defined(__ARM_FEATURE_CRC32)
+	update = update_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len) {
+	pthread_once(&once, init);
+	return ~update(~crc, data, len);
+}
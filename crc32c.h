@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t
+
+/* CRC-32C (Castagnoli) of len bytes, continuing from crc. start with 0. */
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len);
@@ -0,0 +1,624 @@
+#include <errno.h>
+#include <fcntl.h> // fcntl(), O_NONBLOCK
+#include <netinet/in.h> // sockaddr_in, must come before the linux header
+#include <linux/netfilter_ipv4.h> // SO_ORIGINAL_DST
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h> // uint8_t
+#include <stdio.h> // fprintf()
+#include <stdlib.h> // calloc()
+#include <string.h> // memcpy()
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h> // close()
+
+#include <opts.h>
+
+#include "pep.h"
+
+/* split-TCP performance-enhancing proxy.
+ *
+ * TCP connections that would enter tun0 are redirected by iptables to
+ * PEP_PORT on this node and terminated here. the byte stream crosses the
+ * radio as segments of our own, and the other node opens an ordinary TCP
+ * connection to the real destination. the radio already retransmits each
+ * fragment in hardware, so the transport on top of it is kept simple: a
+ * fixed window as large as the receiver's buffer, no slow start, cumulative
+ * acks and go-back-N on timeout or duplicate acks.
+ *
+ * a segment looks like an IP header as far as listen_and_defragment() is
+ * concerned, i.e. the total length is in bytes 2 and 3:
+ *
+ *   0      1      2-3     4-5     6-9   10-13  14-15
+ *   magic  flags  length  stream  seq   ack    window
+ *
+ * the initiator of a stream spends sequence number 0 on PEP_OPEN, whose
+ * payload is the destination address and port. data starts at 1 in both
+ * directions and PEP_FIN takes one sequence number after the last byte.
+ */
+
+#define PEP_HDR_LEN	16
+#define PEP_MSS		(MTU - PEP_HDR_LEN)
+
+#define PEP_OPEN	0x01
+#define PEP_FIN		0x02
+#define PEP_RST		0x04
+
+#define PEP_BUF_SIZE	65536	/* per direction of a stream */
+#define PEP_MAX_WINDOW	65535
+#define PEP_MAX_STREAMS	64
+#define PEP_RTO_MS	500
+#define PEP_MAX_RETRIES	20
+#define PEP_DUP_ACKS	3	/* resend without waiting for the timeout */
+#define PEP_LINGER_MS	2000	/* keep acking the peer's FIN after we are done */
+#define PEP_POLL_MS	100
+
+/* both ends hand out stream ids, the lowest bit tells whose it is. */
+#ifdef BASE_STATION
+#define PEP_ID_ROLE	1
+#else
+#define PEP_ID_ROLE	0
+#endif
+
+#define seq_lt(a, b)	((int32_t) ((a) - (b)) < 0)
+#define min(a, b)	((a) < (b) ? (a) : (b))
+
+struct pep_stream {
+	uint16_t id;
+	int initiator;
+	int sock;
+	int connecting;
+	int wake_fd;
+	struct sockaddr_in dst;
+	pthread_mutex_t lock;
+
+	/* radio side, send direction */
+	uint8_t snd_buf[PEP_BUF_SIZE];
+	uint32_t snd_una;	/* oldest unacked */
+	uint32_t snd_nxt;	/* next to put on the air */
+	uint32_t snd_max;	/* highest sent so far */
+	uint32_t snd_end;	/* end of what we have read from the socket */
+	uint32_t snd_wnd;	/* as advertised by the peer */
+	int snd_fin;
+	uint32_t snd_fin_seq;
+	int snd_open;		/* PEP_OPEN not acked yet */
+	uint64_t rto_deadline;	/* 0 when the timer is not running */
+	int dup_acks;
+	int retries;
+
+	/* radio side, receive direction */
+	uint8_t rcv_buf[PEP_BUF_SIZE];
+	uint32_t rcv_nxt;	/* next expected from the peer */
+	uint32_t rcv_read;	/* next to write to the socket */
+	uint32_t rcv_wnd;	/* last advertised */
+	int rcv_fin;
+	uint32_t rcv_fin_seq;
+	int shut_wr;
+	int ack_pending;
+
+	int reset;		/* peer sent PEP_RST */
+	int reset_local;	/* we have to send one */
+	uint64_t linger_deadline;
+};
+
+static struct pep_stream *streams[PEP_MAX_STREAMS];
+static pthread_mutex_t streams_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint16_t next_id;
+static void (*pep_send)(uint8_t *packet, size_t size);
+
+static void put16(uint8_t *p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+static uint16_t get16(const uint8_t *p) {
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p) {
+	return ((uint32_t) get16(p) << 16) | get16(p + 2);
+}
+
+static void wake(struct pep_stream *s) {
+	uint64_t one = 1;
+	write(s->wake_fd, &one, sizeof(one));
+}
+
+static uint32_t rcv_space(struct pep_stream *s) {
+	uint32_t space = PEP_BUF_SIZE - (s->rcv_nxt - s->rcv_read);
+	return min(space, PEP_MAX_WINDOW);
+}
+
+/* called with streams_lock held. */
+static struct pep_stream *find_stream(uint16_t id) {
+	for (int i = 0; i < PEP_MAX_STREAMS; ++i) {
+		if (streams[i] && streams[i]->id == id)
+			return streams[i];
+	}
+	return NULL;
+}
+
+/* called with streams_lock held. */
+static struct pep_stream *new_stream(uint16_t id, int initiator) {
+	int i;
+	for (i = 0; i < PEP_MAX_STREAMS && streams[i]; ++i)
+		;
+	if (i == PEP_MAX_STREAMS)
+		return NULL;
+
+	struct pep_stream *s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (s->wake_fd < 0) {
+		free(s);
+		return NULL;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	s->id = id;
+	s->initiator = initiator;
+	s->sock = -1;
+	s->dst.sin_family = AF_INET;
+
+	/* the initiator still has to get PEP_OPEN across, the acceptor is
+	 * created by it.
+	 */
+	s->snd_una = s->snd_nxt = s->snd_max = initiator ? 0 : 1;
+	s->snd_open = initiator;
+	s->snd_end = 1;
+	s->snd_wnd = PEP_MAX_WINDOW;
+	s->rcv_nxt = s->rcv_read = 1;
+	s->rcv_wnd = rcv_space(s);
+	s->ack_pending = !initiator;
+
+	streams[i] = s;
+	return s;
+}
+
+static void free_stream(struct pep_stream *s) {
+	pthread_mutex_lock(&streams_lock);
+	for (int i = 0; i < PEP_MAX_STREAMS; ++i) {
+		if (streams[i] == s)
+			streams[i] = NULL;
+	}
+	pthread_mutex_unlock(&streams_lock);
+
+	/* pep_input() takes the stream lock before it lets go of the table,
+	 * so once we get it no one else can be looking at the stream.
+	 */
+	pthread_mutex_lock(&s->lock);
+	pthread_mutex_unlock(&s->lock);
+
+	if (s->sock >= 0) {
+		if (s->reset || s->reset_local) {
+			/* make the application see a reset too */
+			struct linger abort = {1, 0};
+			setsockopt(s->sock, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+		}
+		close(s->sock);
+	}
+	close(s->wake_fd);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+static size_t make_header(struct pep_stream *s, uint8_t *seg, uint8_t flags, uint32_t seq, size_t len) {
+	s->rcv_wnd = rcv_space(s);
+	s->ack_pending = 0;
+
+	seg[0] = PEP_MAGIC;
+	seg[1] = flags;
+	put16(seg + 2, PEP_HDR_LEN + len);
+	put16(seg + 4, s->id);
+	put32(seg + 6, seq);
+	put32(seg + 10, s->rcv_nxt);
+	put16(seg + 14, s->rcv_wnd);
+	return PEP_HDR_LEN + len;
+}
+
+/* fills in the next segment to put on the air and returns its length, 0
+ * if there is nothing to send. with force set, one segment goes out even
+ * if the peer's window is closed so that we learn when it opens again.
+ */
+static size_t next_segment(struct pep_stream *s, uint8_t *seg, int force) {
+	uint32_t limit = s->snd_una + s->snd_wnd;
+	uint8_t flags = 0;
+	size_t len = 0;
+
+	if (s->reset_local)
+		return make_header(s, seg, PEP_RST, s->snd_nxt, 0);
+
+	if (force && s->snd_wnd == 0)
+		limit = s->snd_una + 1;
+
+	if (s->snd_nxt == s->snd_end || !seq_lt(s->snd_nxt, limit)) {
+		if (!s->ack_pending)
+			return 0;
+		return make_header(s, seg, 0, s->snd_nxt, 0);
+	}
+
+	/* after 4 GiB the data gets to sequence number 0 as well */
+	uint32_t seq = s->snd_nxt;
+	if (s->snd_open && seq == s->snd_una) {
+		flags = PEP_OPEN;
+		memcpy(seg + PEP_HDR_LEN, &s->dst.sin_addr.s_addr, 4);
+		memcpy(seg + PEP_HDR_LEN + 4, &s->dst.sin_port, 2);
+		len = 6;
+		s->snd_nxt = 1;
+	} else if (s->snd_fin && seq == s->snd_fin_seq) {
+		flags = PEP_FIN;
+		s->snd_nxt++;
+	} else {
+		uint32_t data_end = s->snd_fin ? s->snd_fin_seq : s->snd_end;
+		len = min(data_end - seq, limit - seq);
+		len = min(len, PEP_MSS);
+
+		size_t off = seq % PEP_BUF_SIZE;
+		size_t first = min(len, PEP_BUF_SIZE - off);
+		memcpy(seg + PEP_HDR_LEN, s->snd_buf + off, first);
+		memcpy(seg + PEP_HDR_LEN + first, s->snd_buf, len - first);
+		s->snd_nxt += len;
+	}
+
+	if (seq_lt(s->snd_max, s->snd_nxt))
+		s->snd_max = s->snd_nxt;
+	if (!s->rto_deadline)
+		s->rto_deadline = now_ms() + PEP_RTO_MS;
+	return make_header(s, seg, flags, seq, len);
+}
+
+static void read_socket(struct pep_stream *s) {
+	uint32_t space = PEP_BUF_SIZE - (s->snd_end - s->snd_una);
+	size_t off = s->snd_end % PEP_BUF_SIZE;
+	size_t chunk = min(space, PEP_BUF_SIZE - off);
+
+	if (s->snd_fin || chunk == 0)
+		return;
+
+	ssize_t n = recv(s->sock, s->snd_buf + off, chunk, 0);
+	if (n > 0) {
+		s->snd_end += n;
+	} else if (n == 0) {
+		s->snd_fin = 1;
+		s->snd_fin_seq = s->snd_end++;
+	} else if (errno != EAGAIN && errno != EINTR) {
+		pr("pep %d: recv: %s\n", s->id, strerror(errno));
+		s->reset_local = 1;
+	}
+}
+
+static void write_socket(struct pep_stream *s) {
+	uint32_t data_end = s->rcv_fin ? s->rcv_fin_seq : s->rcv_nxt;
+	size_t off = s->rcv_read % PEP_BUF_SIZE;
+	size_t chunk = min(data_end - s->rcv_read, PEP_BUF_SIZE - off);
+
+	if (chunk > 0) {
+		ssize_t n = send(s->sock, s->rcv_buf + off, chunk, MSG_NOSIGNAL);
+		if (n > 0) {
+			s->rcv_read += n;
+		} else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			pr("pep %d: send: %s\n", s->id, strerror(errno));
+			s->reset_local = 1;
+			return;
+		}
+	}
+
+	/* tell the peer about the window we just opened before it has to
+	 * probe for it.
+	 */
+	if (rcv_space(s) >= s->rcv_wnd + PEP_BUF_SIZE / 4)
+		s->ack_pending = 1;
+}
+
+static int start_connect(struct pep_stream *s) {
+	int mark = PEP_MARK;
+
+	s->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (s->sock < 0)
+		return -1;
+	/* keep iptables from redirecting us back to ourselves */
+	setsockopt(s->sock, SOL_SOCKET, SO_MARK, &mark, sizeof(mark));
+	if (connect(s->sock, (struct sockaddr *) &s->dst, sizeof(s->dst)) < 0 && errno != EINPROGRESS)
+		return -1;
+	s->connecting = 1;
+	return 0;
+}
+
+static int finish_connect(struct pep_stream *s) {
+	int err;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(s->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+		return -1;
+	s->connecting = 0;
+	return 0;
+}
+
+static int is_done(struct pep_stream *s) {
+	return s->snd_fin && s->snd_una == s->snd_end
+		&& s->rcv_fin && s->shut_wr;
+}
+
+static void *run_stream(void *argument) {
+	struct pep_stream *s = argument;
+	uint8_t seg[MTU];
+	size_t len;
+
+	pthread_detach(pthread_self());
+
+	pthread_mutex_lock(&s->lock);
+	if (!s->initiator && start_connect(s) < 0) {
+		pr("pep %d: connect: %s\n", s->id, strerror(errno));
+		s->reset_local = 1;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	while (1) {
+		struct pollfd fds[2] = {
+			{ .fd = s->sock },
+			{ .fd = s->wake_fd, .events = POLLIN },
+		};
+		int timeout = PEP_POLL_MS;
+		int force = 0;
+
+		pthread_mutex_lock(&s->lock);
+		if (s->connecting) {
+			fds[0].events = POLLOUT;
+		} else {
+			if (!s->snd_fin && s->snd_end - s->snd_una < PEP_BUF_SIZE)
+				fds[0].events |= POLLIN;
+			if (s->rcv_read != (s->rcv_fin ? s->rcv_fin_seq : s->rcv_nxt))
+				fds[0].events |= POLLOUT;
+		}
+		/* a socket shut down both ways always polls as POLLHUP, so
+		 * leave it out when there is nothing we want from it.
+		 */
+		if (s->reset_local || fds[0].events == 0)
+			fds[0].fd = -1;
+		if (s->rto_deadline) {
+			int64_t left = (int64_t) (s->rto_deadline - now_ms());
+			timeout = left < 0 ? 0 : min(left, timeout);
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		poll(fds, 2, timeout);
+
+		pthread_mutex_lock(&s->lock);
+		if (fds[1].revents & POLLIN) {
+			uint64_t count;
+			read(s->wake_fd, &count, sizeof(count));
+		}
+		if (s->reset) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		if (s->connecting && fds[0].revents) {
+			if (finish_connect(s) < 0) {
+				pr("pep %d: connect failed\n", s->id);
+				s->reset_local = 1;
+			}
+		} else if (!s->reset_local) {
+			if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+				read_socket(s);
+			if (fds[0].revents & POLLOUT)
+				write_socket(s);
+			if (s->rcv_fin && s->rcv_read == s->rcv_fin_seq && !s->shut_wr) {
+				shutdown(s->sock, SHUT_WR);
+				s->shut_wr = 1;
+			}
+		}
+
+		if (s->reset_local) {
+			len = next_segment(s, seg, 0);
+			pthread_mutex_unlock(&s->lock);
+			pep_send(seg, len);
+			break;
+		}
+
+		uint64_t now = now_ms();
+		if (!s->rto_deadline && s->snd_nxt != s->snd_end) {
+			/* window closed with data waiting, probe it later */
+			s->rto_deadline = now + PEP_RTO_MS;
+		} else if (s->rto_deadline && now >= s->rto_deadline) {
+			if (++s->retries > PEP_MAX_RETRIES) {
+				pr("pep %d: peer gone\n", s->id);
+				s->reset_local = 1;
+				pthread_mutex_unlock(&s->lock);
+				continue;
+			}
+			pr("pep %d: timeout, resending from %u\n", s->id, s->snd_una);
+			s->snd_nxt = s->snd_una;
+			s->rto_deadline = 0;
+			s->dup_acks = 0;
+			force = 1;
+		}
+
+		if (is_done(s)) {
+			if (!s->linger_deadline) {
+				s->linger_deadline = now + PEP_LINGER_MS;
+			} else if (now >= s->linger_deadline) {
+				pthread_mutex_unlock(&s->lock);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		/* the radio is slow, do not hold the lock while on the air or
+		 * pep_input() would stall the receiving thread.
+		 */
+		while (1) {
+			pthread_mutex_lock(&s->lock);
+			len = next_segment(s, seg, force);
+			pthread_mutex_unlock(&s->lock);
+			if (len == 0)
+				break;
+			pep_send(seg, len);
+			force = 0;
+		}
+	}
+
+	pr("pep %d: closed\n", s->id);
+	free_stream(s);
+	return NULL;
+}
+
+void pep_init(void (*send)(uint8_t *packet, size_t size)) {
+	pep_send = send;
+}
+
+void *pep_listen(void *argument) {
+	(void) argument;
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(PEP_PORT),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	int one = 1;
+
+	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		pr("pep: socket: %s\n", strerror(errno));
+		return NULL;
+	}
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0) {
+		pr("pep: cannot listen on %d: %s\n", PEP_PORT, strerror(errno));
+		close(listen_fd);
+		return NULL;
+	}
+
+	while (1) {
+		struct sockaddr_in dst, self;
+		socklen_t dst_len = sizeof(dst);
+		socklen_t self_len = sizeof(self);
+
+		int sock = accept(listen_fd, NULL, NULL);
+		if (sock < 0)
+			continue;
+		/* conntrack has an original destination for every connection.
+		 * one that came to PEP_PORT directly has ourselves there, and
+		 * the peer would only connect back to its own proxy with it.
+		 */
+		if (getsockopt(sock, SOL_IP, SO_ORIGINAL_DST, &dst, &dst_len) < 0
+				|| getsockname(sock, (struct sockaddr *) &self, &self_len) < 0
+				|| (dst.sin_addr.s_addr == self.sin_addr.s_addr && dst.sin_port == self.sin_port)) {
+			pr("pep: not a redirected connection\n");
+			close(sock);
+			continue;
+		}
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+		pthread_mutex_lock(&streams_lock);
+		uint16_t id;
+		do {
+			id = (next_id++ << 1) | PEP_ID_ROLE;
+		} while (find_stream(id));
+		struct pep_stream *s = new_stream(id, 1);
+		if (s) {
+			s->sock = sock;
+			s->dst = dst;
+		}
+		pthread_mutex_unlock(&streams_lock);
+
+		pthread_t thread;
+		if (!s) {
+			pr("pep: too many streams\n");
+			close(sock);
+		} else if (pthread_create(&thread, NULL, run_stream, s)) {
+			free_stream(s);
+		} else {
+			pr("pep %d: opened\n", id);
+		}
+	}
+}
+
+void pep_input(uint8_t *packet, size_t size) {
+	if (size < PEP_HDR_LEN)
+		return;
+
+	uint8_t flags = packet[1];
+	uint16_t id = get16(packet + 4);
+	uint32_t seq = get32(packet + 6);
+	uint32_t ack = get32(packet + 10);
+	uint16_t window = get16(packet + 14);
+	uint8_t *data = packet + PEP_HDR_LEN;
+	size_t len = size - PEP_HDR_LEN;
+
+	pthread_mutex_lock(&streams_lock);
+	struct pep_stream *s = find_stream(id);
+	if (!s && (flags & PEP_OPEN) && len >= 6) {
+		s = new_stream(id, 0);
+		if (s) {
+			memcpy(&s->dst.sin_addr.s_addr, data, 4);
+			memcpy(&s->dst.sin_port, data + 4, 2);
+			pthread_t thread;
+			if (pthread_create(&thread, NULL, run_stream, s)) {
+				pthread_mutex_unlock(&streams_lock);
+				free_stream(s);
+				return;
+			}
+			pr("pep %d: accepted\n", id);
+		}
+	}
+	if (!s) {
+		/* the peer gives up on its own after PEP_MAX_RETRIES */
+		pthread_mutex_unlock(&streams_lock);
+		return;
+	}
+	pthread_mutex_lock(&s->lock);
+	pthread_mutex_unlock(&streams_lock);
+
+	if (flags & PEP_RST) {
+		s->reset = 1;
+		goto out;
+	}
+
+	/* anything at all from the peer means it is still there */
+	s->retries = 0;
+
+	if (seq_lt(s->snd_una, ack) && !seq_lt(s->snd_max, ack)) {
+		s->snd_una = ack;
+		s->snd_open = 0;
+		if (seq_lt(s->snd_nxt, ack))
+			s->snd_nxt = ack;
+		s->rto_deadline = s->snd_una == s->snd_max ? 0 : now_ms() + PEP_RTO_MS;
+		s->dup_acks = 0;
+	} else if (ack == s->snd_una && s->snd_una != s->snd_max && window == s->snd_wnd) {
+		/* the peer only takes segments in order, so repeated acks mean
+		 * one got lost and everything after it has to go again.
+		 */
+		if (++s->dup_acks == PEP_DUP_ACKS)
+			s->snd_nxt = s->snd_una;
+	}
+	s->snd_wnd = window;
+
+	if (flags & PEP_OPEN) {
+		/* a retransmission, our ack got lost */
+		s->ack_pending = 1;
+	} else if (len > 0 || (flags & PEP_FIN)) {
+		if (seq == s->rcv_nxt && !s->rcv_fin) {
+			size_t take = min(len, rcv_space(s));
+			size_t off = seq % PEP_BUF_SIZE;
+			size_t first = min(take, PEP_BUF_SIZE - off);
+			memcpy(s->rcv_buf + off, data, first);
+			memcpy(s->rcv_buf, data + first, take - first);
+			s->rcv_nxt += take;
+			if ((flags & PEP_FIN) && take == len) {
+				s->rcv_fin = 1;
+				s->rcv_fin_seq = s->rcv_nxt++;
+			}
+		}
+		/* ack everything, duplicates and window probes included */
+		s->ack_pending = 1;
+	}
+
+out:
+	wake(s);
+	pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t
+
+/* the first byte of every split-TCP segment. an IP packet starts with its
+ * version nibble (4 or 6), so the receiver can tell the two apart.
+ */
+#define PEP_MAGIC	0xf0
+
+#define pep_is_segment(packet)	((packet)[0] == PEP_MAGIC)
+
+/* send is called from several threads and must put one whole segment on the
+ * radio, like fragment_and_send() does for an IP packet.
+ */
+void pep_init(void (*send)(uint8_t *packet, size_t size));
+void *pep_listen(void *argument);
+void pep_input(uint8_t *packet, size_t size);
@@ -220,5 +220,10 @@ cbool rf24_testRPD(RF24Handle rf_handle) {
   return cbool(r->testRPD());
 }
 
+uint8_t rf24_getARC(RF24Handle rf_handle) {
+  RF24* r = to_rf(rf_handle);
+  return r->getARC();
+}
+
 
 
@@ -28,6 +28,10 @@ typedef uint8_t rf24_crclength_val;
 #define RF24_PA_MAX 3
 #define RF24_PA_ERROR 4
 
+#define RF24_CRC_DISABLED 0
+#define RF24_CRC_8 1
+#define RF24_CRC_16 2
+
 #ifdef __cplusplus
 #define DLL extern "C"
 #else
@@ -75,4 +79,5 @@ DLL void rf24_powerUp(RF24Handle rf_handle);
 DLL void rf24_whatHappened(RF24Handle rf_handle, cbool* out_tx_ok, cbool* out_tx_fail, cbool* out_rx_ready);
 DLL cbool rf24_testCarrier(RF24Handle rf_handle);
 DLL cbool rf24_testRPD(RF24Handle rf_handle);
+DLL uint8_t rf24_getARC(RF24Handle rf_handle);
 
@@ -24,6 +24,17 @@ iptables -t nat -A POSTROUTING -o $ETHERNET_INTERFACE -j MASQUERADE # Slides say
 iptables -A FORWARD -m conntrack --ctstate RELATED,ESTABLISHED -j ACCEPT # From arch wiki, ChatGPT claims it is more modern
 iptables -A FORWARD -i $VIRT_INTERFACE -o $ETHERNET_INTERFACE -j ACCEPT
 
+# Split-TCP proxy (pep.c), needs SPLIT_TCP in common.h as well
+# TCP towards the tunnel is terminated by the proxy, which
+# marks its own sockets so they are left alone
+SPLIT_TCP=0
+PEP_PORT=5555
+PEP_MARK=0x24
+if ((SPLIT_TCP)); then
+    iptables -t nat -A PREROUTING -i $ETHERNET_INTERFACE -d 11.11.11.0/24 -p tcp -j REDIRECT --to-ports $PEP_PORT
+    iptables -t nat -A OUTPUT -o $VIRT_INTERFACE -p tcp -m mark ! --mark $PEP_MARK -j REDIRECT --to-ports $PEP_PORT
+fi
+
 # Rate limiting
 # Lecture 4.1 - IPTables
 # iptables -A FORWARD -i $ETHERNET_INTERFACE -o $VIRT_INTERFACE -m state --state RELATED,ESTABLISHED -m limit --limit 10/sec -j ACCEPT
@@ -16,3 +16,13 @@ ip link set dev $VIRT_INTERFACE up
 
 ip route add 8.8.8.8 dev $VIRT_INTERFACE
 ip route add 194.47.245.203 dev $VIRT_INTERFACE
+
+# Split-TCP proxy (pep.c), needs SPLIT_TCP in common.h as well
+# Locally originated TCP towards the tunnel is terminated by the proxy, which
+# marks its own sockets so they are left alone
+SPLIT_TCP=0
+PEP_PORT=5555
+PEP_MARK=0x24
+if ((SPLIT_TCP)); then
+    iptables -t nat -A OUTPUT -o $VIRT_INTERFACE -p tcp -m mark ! --mark $PEP_MARK -j REDIRECT --to-ports $PEP_PORT
+fi
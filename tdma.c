@@ -0,0 +1,215 @@
+#include <pthread.h>
+#include <stdint.h> // uint8_t
+#include <stdio.h> // fprintf()
+#include <string.h> // memcpy()
+
+#include <opts.h>
+
+#include "tdma.h"
+
+/* TDMA frames for running both directions on one radio.
+ *
+ * the base station starts every frame with a beacon giving the length of
+ * the downlink and the uplink slot, sends what fits in the downlink slot,
+ * marks the end of it and listens for the rest of the frame. the mobile unit
+ * listens until the end marker, or TDMA_END_WAIT_MS past the downlink slot
+ * if it misses that, sends what fits, reports what is left over and goes
+ * back to listening. that report ends the frame for the base station.
+ *
+ * what fits is judged from the time sending actually took so far, with
+ * TDMA_MARGIN_PCT on top. the first packet of a slot goes out even if it does
+ * not fit, the receiver is busy with it until it is done.
+ *
+ * slots are sized from the backlog on either side, so a one-way transfer
+ * gets nearly all of the air time and a side with nothing queued only gets
+ * TDMA_MIN_SLOT_MS and room to mark its end. when both are busy they share
+ * the frame in proportion to their backlog, but each gets room for a full
+ * packet, or half the frame if a full packet takes longer than that.
+ *
+ *   0      1     2-3     4-5                      6-7
+ *   magic  type  length  downlink ms or backlog  uplink ms
+ */
+
+#define TDMA_MSG_LEN	8
+
+#define TDMA_QUEUE_LEN	64
+#define TDMA_FRAGMENT_US	2000	/* a fragment with its ack, send_delay and a retry, until measured */
+#define TDMA_MARGIN_PCT	25	/* on top of the measured time */
+#define TDMA_MIN_SLOT_MS	3
+#define TDMA_MAX_FRAME_MS	250
+
+#define fragments(size)	(((size) + CRC_TRAILER + DATA_SIZE - 1) / DATA_SIZE)
+
+struct tdma_packet {
+	size_t size;
+	uint8_t data[MTU];
+};
+
+static struct tdma_packet queue[TDMA_QUEUE_LEN];
+static size_t queue_head, queue_count;
+static uint32_t queued_fragments;
+static uint32_t fragment_us = TDMA_FRAGMENT_US;	/* moving average of what sending took */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef BASE_STATION
+static uint32_t peer_backlog_ms;	/* from the last report, 0 if we missed it */
+#endif
+
+static size_t make_message(uint8_t *msg, uint8_t type, uint16_t a, uint16_t b) {
+	msg[0] = TDMA_MAGIC;
+	msg[1] = type;
+	msg[2] = 0;
+	msg[3] = TDMA_MSG_LEN;
+	msg[4] = a >> 8;
+	msg[5] = a;
+	msg[6] = b >> 8;
+	msg[7] = b;
+	return TDMA_MSG_LEN;
+}
+
+/* called with queue_lock held. */
+static uint32_t airtime_ms(uint32_t frags) {
+	uint64_t us = (uint64_t) frags * fragment_us * (100 + TDMA_MARGIN_PCT) / 100;
+	return (us + 999) / 1000;
+}
+
+/* called with queue_lock held. */
+static uint32_t backlog_ms(void) {
+	uint32_t ms = airtime_ms(queued_fragments);
+	return ms > UINT16_MAX ? UINT16_MAX : ms;
+}
+
+void tdma_enqueue(uint8_t *packet, size_t size) {
+	if (size > MTU) {
+		pr("tdma: packet of %ld bytes does not fit a slot\n", size);
+		return;
+	}
+
+	pthread_mutex_lock(&queue_lock);
+	if (queue_count == TDMA_QUEUE_LEN) {
+		pr("tdma: queue full, dropping\n");
+	} else {
+		struct tdma_packet *p = &queue[(queue_head + queue_count) % TDMA_QUEUE_LEN];
+		memcpy(p->data, packet, size);
+		p->size = size;
+		queue_count++;
+		queued_fragments += fragments(size);
+	}
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/* the next packet if it can be on the air before deadline, or if it is the
+ * first of the slot, else 0. a packet too long for any slot would otherwise
+ * hold up the queue for good.
+ */
+size_t tdma_dequeue(uint8_t *packet, uint64_t deadline, int first) {
+	size_t size = 0;
+
+	pthread_mutex_lock(&queue_lock);
+	if (queue_count > 0) {
+		struct tdma_packet *p = &queue[queue_head];
+		if (first || now_ms() + airtime_ms(fragments(p->size)) <= deadline) {
+			size = p->size;
+			memcpy(packet, p->data, size);
+			queue_head = (queue_head + 1) % TDMA_QUEUE_LEN;
+			queue_count--;
+			queued_fragments -= fragments(size);
+		}
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return size;
+}
+
+/* how long a packet that made it took to send, for the next estimates. */
+void tdma_sent(size_t size, uint64_t elapsed_us) {
+	uint32_t us = elapsed_us / fragments(size);
+
+	pthread_mutex_lock(&queue_lock);
+	fragment_us = fragment_us - fragment_us / 8 + us / 8;
+	pthread_mutex_unlock(&queue_lock);
+}
+
+#ifdef BASE_STATION
+size_t tdma_plan(uint8_t *beacon, struct tdma_frame *frame) {
+	uint32_t budget = TDMA_MAX_FRAME_MS - 2 * TDMA_GUARD_MS;
+
+	pthread_mutex_lock(&queue_lock);
+	uint32_t marker = airtime_ms(1);
+	uint32_t room = TDMA_MIN_SLOT_MS + marker + airtime_ms(fragments(MTU));
+	if (room > budget / 2)
+		room = budget / 2;
+	uint32_t down = TDMA_MIN_SLOT_MS + marker + backlog_ms();
+	uint32_t up = TDMA_MIN_SLOT_MS + marker + peer_backlog_ms;
+	peer_backlog_ms = 0;
+	pthread_mutex_unlock(&queue_lock);
+
+	if (down + up > budget) {
+		uint32_t down_least = down < room ? down : room;
+		uint32_t up_least = up < room ? up : room;
+
+		down = budget * down / (down + up);
+		if (down < down_least)
+			down = down_least;
+		up = budget - down;
+		if (up < up_least) {
+			up = up_least;
+			down = budget - up;
+		}
+	}
+	pr("tdma: downlink %d ms, uplink %d ms\n", down, up);
+
+	uint64_t now = now_ms();
+	frame->downlink_end = now + down - marker;
+	/* the latest the mobile unit starts, if it misses the end marker. it
+	 * heard the beacon a little after we sent it.
+	 */
+	frame->uplink_start = now + down + TDMA_END_WAIT_MS;
+	frame->uplink_end = frame->uplink_start + up + TDMA_GUARD_MS;
+	frame->uplink_ms = up;
+	return make_message(beacon, TDMA_BEACON, down, up);
+}
+
+size_t tdma_end(uint8_t *marker) {
+	return make_message(marker, TDMA_END, 0, 0);
+}
+#endif
+
+size_t tdma_report(uint8_t *report) {
+	pthread_mutex_lock(&queue_lock);
+	uint32_t backlog = backlog_ms();
+	pthread_mutex_unlock(&queue_lock);
+
+	return make_message(report, TDMA_REPORT, backlog, 0);
+}
+
+/* returns the type of the message, or -1. a beacon fills in frame and an
+ * end marker moves its uplink slot forward. either way uplink_end leaves
+ * room for the report after it.
+ */
+int tdma_input(uint8_t *packet, size_t size, struct tdma_frame *frame) {
+	if (size < TDMA_MSG_LEN)
+		return -1;
+
+	pthread_mutex_lock(&queue_lock);
+	uint32_t report = airtime_ms(1);
+	pthread_mutex_unlock(&queue_lock);
+
+	if (packet[1] == TDMA_BEACON && frame) {
+		frame->downlink_end = now_ms() + ((packet[4] << 8) | packet[5]);
+		frame->uplink_start = frame->downlink_end + TDMA_END_WAIT_MS;
+		frame->uplink_ms = (packet[6] << 8) | packet[7];
+		frame->uplink_end = frame->uplink_start + frame->uplink_ms - report;
+	}
+	if (packet[1] == TDMA_END && frame) {
+		frame->uplink_start = now_ms() + TDMA_GUARD_MS;
+		frame->uplink_end = frame->uplink_start + frame->uplink_ms - report;
+	}
+#ifdef BASE_STATION
+	if (packet[1] == TDMA_REPORT) {
+		pthread_mutex_lock(&queue_lock);
+		peer_backlog_ms = (packet[4] << 8) | packet[5];
+		pthread_mutex_unlock(&queue_lock);
+	}
+#endif
+	return packet[1];
+}
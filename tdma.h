@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t, uint64_t
+
+/* the first byte of a beacon, end marker or backlog report, see pep.h. */
+#define TDMA_MAGIC	0xf2
+
+#define tdma_is_message(packet)	((packet)[0] == TDMA_MAGIC)
+
+/* the second byte. */
+#define TDMA_BEACON	0
+#define TDMA_REPORT	1
+#define TDMA_END	2
+
+#define TDMA_GUARD_MS	2	/* for turning the radios around */
+#define TDMA_END_WAIT_MS	10	/* past the downlink slot, before a lost end marker is assumed */
+
+/* all in now_ms() time. */
+struct tdma_frame {
+	uint64_t downlink_end;
+	uint64_t uplink_start;
+	uint64_t uplink_end;
+	uint32_t uplink_ms;
+};
+
+void tdma_enqueue(uint8_t *packet, size_t size);
+size_t tdma_dequeue(uint8_t *packet, uint64_t deadline, int first);
+void tdma_sent(size_t size, uint64_t elapsed_us);
+
+size_t tdma_plan(uint8_t *beacon, struct tdma_frame *frame);
+size_t tdma_end(uint8_t *marker);
+size_t tdma_report(uint8_t *report);
+int tdma_input(uint8_t *packet, size_t size, struct tdma_frame *frame);
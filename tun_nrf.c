@@ -15,32 +15,32 @@
 
 #include <opts.h>
 
-#define PRINT		0	/* enable/disable prints. */
-
-/* the funny do-while next clearly performs one iteration of the loop.
- * if you are really curious about why there is a loop, please check
- * the course book about the C preprocessor where it is explained. it
- * is to avoid bugs and/or syntax errors in case you use the pr in an
- * if-statement without { }.
- *
- */
+#include "channel.h"
+#include "crc32c.h"
+#include "pep.h"
+#include "tdma.h"
 
-#if PRINT
-#define pr(...)		do { fprintf(stderr, __VA_ARGS__); } while (0)
-#else
-#define pr(...)		/* no effect at all */
+#if TDMA && CHANNEL_MANAGER
+#error "the channel manager needs one radio per direction"
 #endif
 
 #define VIRTUAL_INTERFACE "tun0"
 #define BUFLEN 65535
-#define MTU 1500
-#define DATA_SIZE 31
+#define RETRY_DELAY 5 /* in steps of 250 µs, after the first */
+#define RETRY_COUNT 15
+/* give up on a packet that stops halfway. a fragment can take every retry
+ * before it gets through, and then there is send_delay.
+ */
+#define FRAGMENT_TIMEOUT_MS ((RETRY_DELAY + 1) * 250 * (RETRY_COUNT + 1) / 1000 + 5)
 
 struct timespec delay = {0, 50000}; // 50 µs
 struct timespec send_delay = {0, 500000}; // 500 µs
 
 uint8_t payload_size;
 
+RF24Handle tx_radio;
+pthread_mutex_t tx_lock = PTHREAD_MUTEX_INITIALIZER; /* the tun reader and the proxy share tx_radio */
+
 
 RF24Handle make_radio(int ce_pin, int csn_pin, int channel, int is_receiver) {
 	uint8_t address[2][2] = {"1", "2"};
@@ -49,6 +49,10 @@ RF24Handle make_radio(int ce_pin, int csn_pin, int channel, int is_receiver) {
 	rf24_setChannel(radio, channel);
 	rf24_setPALevel(radio, RF24_PA_LOW);
 	rf24_setDataRate(radio, 1);
+	rf24_setRetries(radio, RETRY_DELAY, RETRY_COUNT);
+#if PACKET_CRC
+	rf24_setCRCLength(radio, RF24_CRC_8);
+#endif
 	rf24_openWritingPipe(radio, address[is_receiver]);
 	rf24_openReadingPipe(radio, 1, address[!is_receiver]);
 
@@ -79,11 +83,16 @@ size_t listen_and_defragment(RF24Handle radio, uint8_t* buffer) {
 	}
 
 	int i;
-	int num_fragments = total_length / DATA_SIZE;
-	if (total_length % DATA_SIZE != 0) ++num_fragments;
+	int num_fragments = (total_length + CRC_TRAILER) / DATA_SIZE;
+	if ((total_length + CRC_TRAILER) % DATA_SIZE != 0) ++num_fragments;
 
 	for (i = 1; i < num_fragments; ++i) {
+		uint64_t give_up = now_ms() + FRAGMENT_TIMEOUT_MS;
 		while (!rf24_available(radio)) {
+			if (now_ms() > give_up) {
+				pr("Fragment %d never came\n", i);
+				return 0;
+			}
 			nanosleep(&delay, NULL);
 		}
 
@@ -99,10 +108,31 @@ size_t listen_and_defragment(RF24Handle radio, uint8_t* buffer) {
 		memcpy(buffer + (i * DATA_SIZE), buf + 1, DATA_SIZE);
 		pr("have received %d/%d fragments, %d/%d bytes\n", i, num_fragments, (i * DATA_SIZE), total_length);
 	}
+
+#if PACKET_CRC
+	uint8_t* trailer = buffer + total_length;
+	uint32_t crc = ((uint32_t) trailer[0] << 24) | (trailer[1] << 16) | (trailer[2] << 8) | trailer[3];
+	if (crc32c(0, buffer, total_length) != crc) {
+		pr("Bad CRC, discarding packet of length %d\n", total_length);
+		return 0;
+	}
+#endif
 	return total_length;
 }
 
-void fragment_and_send(RF24Handle radio, uint8_t* payload, ssize_t size) {
+int fragment_and_send(RF24Handle radio, uint8_t* payload, ssize_t size) {
+#if PACKET_CRC
+	uint8_t framed[size + CRC_TRAILER];
+	uint32_t crc = crc32c(0, payload, size);
+	memcpy(framed, payload, size);
+	framed[size] = crc >> 24;
+	framed[size + 1] = crc >> 16;
+	framed[size + 2] = crc >> 8;
+	framed[size + 3] = crc;
+	payload = framed;
+	size += CRC_TRAILER;
+#endif
+
 	int num_fragments = size / DATA_SIZE;
 	if (size % DATA_SIZE != 0) ++num_fragments;
 
@@ -111,14 +141,51 @@ void fragment_and_send(RF24Handle radio, uint8_t* payload, ssize_t size) {
 		size_t cur_size = size - (i * DATA_SIZE) < DATA_SIZE ? size - (i * DATA_SIZE) : DATA_SIZE;
 		uint8_t bytes[DATA_SIZE + 1];
 		bytes[0] = i;
-		memcpy(bytes + 1, data, DATA_SIZE);
+		memcpy(bytes + 1, data, cur_size);
 		int success = rf24_write(radio, bytes, cur_size + 1);
+#if CHANNEL_MANAGER
+		chan_tx_done(radio, success);
+#endif
 		if (!success) {
 			pr("Transmission failed\n");
-			return;
+			return 0;
 		}
 		nanosleep(&send_delay, NULL);
 	}
+	return 1;
+}
+
+void send_packet(uint8_t* packet, size_t size) {
+#if TDMA
+	tdma_enqueue(packet, size);
+#else
+	pthread_mutex_lock(&tx_lock);
+	if (tx_radio) {
+#if CHANNEL_MANAGER
+		chan_poll_tx(tx_radio);
+#endif
+		fragment_and_send(tx_radio, packet, size);
+	}
+	pthread_mutex_unlock(&tx_lock);
+#endif
+}
+
+/* hands a packet from the radio to whoever it is for. */
+void deliver(int tun_fd, uint8_t* packet, size_t size) {
+	pr("received %ld bytes\n", size);
+#if SPLIT_TCP
+	if (pep_is_segment(packet)) {
+		pep_input(packet, size);
+		return;
+	}
+#endif
+#if CHANNEL_MANAGER
+	if (chan_is_message(packet)) {
+		chan_input(packet, size);
+		return;
+	}
+#endif
+	write(tun_fd, packet, size);
 }
 
 void *do_receive(void *argument) {
@@ -131,20 +198,108 @@ void *do_receive(void *argument) {
 
 	while (1) {
 		size_t size = listen_and_defragment(radio, buf);
-		if (size > 0) {
-			pr("received %ld bytes\n", size);
-			write(tun_fd, buf, size);
+		if (size > 0)
+			deliver(tun_fd, buf, size);
+#if CHANNEL_MANAGER
+		chan_poll_rx(radio);
+#endif
+	}
+}
+
+#if TDMA
+/* sends in a slot, and lets tdma.c know how long that took. */
+void send_timed(RF24Handle radio, uint8_t* packet, size_t size) {
+	uint64_t start = now_us();
+	if (fragment_and_send(radio, packet, size))
+		tdma_sent(size, now_us() - start);
+}
+
+#ifdef BASE_STATION
+void *do_tdma(void *argument) {
+	int tun_fd = *((int *) argument);
+
+	RF24Handle radio = make_radio(RX_CE_PIN, RX_CSN_PIN, TDMA_CHANNEL, 0);
+	uint8_t buf[BUFLEN];
+	struct tdma_frame frame;
+
+	while (1) {
+		rf24_stopListening(radio);
+		size_t len = tdma_plan(buf, &frame);
+		send_timed(radio, buf, len);
+		for (int first = 1; (len = tdma_dequeue(buf, frame.downlink_end, first)); first = 0)
+			send_timed(radio, buf, len);
+		len = tdma_end(buf);
+		send_timed(radio, buf, len);
+
+		rf24_startListening(radio);
+		while (now_ms() < frame.uplink_end) {
+			size_t size = listen_and_defragment(radio, buf);
+			if (size == 0)
+				continue;
+			if (!tdma_is_message(buf))
+				deliver(tun_fd, buf, size);
+			else if (tdma_input(buf, size, NULL) == TDMA_REPORT)
+				break;
+		}
+	}
+}
+#else
+void *do_tdma(void *argument) {
+	int tun_fd = *((int *) argument);
+
+	RF24Handle radio = make_radio(RX_CE_PIN, RX_CSN_PIN, TDMA_CHANNEL, 1);
+	uint8_t buf[BUFLEN];
+	struct tdma_frame frame;
+
+	rf24_startListening(radio);
+	while (1) {
+		size_t size = listen_and_defragment(radio, buf);
+		if (size == 0)
+			continue;
+		if (!tdma_is_message(buf)) {
+			deliver(tun_fd, buf, size);
+			continue;
 		}
+		if (tdma_input(buf, size, &frame) != TDMA_BEACON)
+			continue;
+
+		/* the rest of the downlink slot, up to the end marker */
+		while (now_ms() < frame.uplink_start) {
+			size = listen_and_defragment(radio, buf);
+			if (size == 0)
+				continue;
+			if (!tdma_is_message(buf))
+				deliver(tun_fd, buf, size);
+			else if (tdma_input(buf, size, &frame) == TDMA_END)
+				break;
+		}
+
+		rf24_stopListening(radio);
+		while (now_ms() < frame.uplink_start)
+			nanosleep(&delay, NULL);
+		size_t len;
+		for (int first = 1; (len = tdma_dequeue(buf, frame.uplink_end, first)); first = 0)
+			send_timed(radio, buf, len);
+		len = tdma_report(buf);
+		send_timed(radio, buf, len);
+		rf24_startListening(radio);
 	}
 }
+#endif
+#endif
 
 void *do_send(void *argument) {
 	int tun_fd = *((int *) argument);
+	uint8_t buf[BUFLEN];
 
+#if !TDMA
 	RF24Handle radio = make_radio(TX_CE_PIN, TX_CSN_PIN, TX_CHANNEL, 0);
-	uint8_t buf[BUFLEN];
 
 	rf24_stopListening(radio);
+	pthread_mutex_lock(&tx_lock);
+	tx_radio = radio;
+	pthread_mutex_unlock(&tx_lock);
+#endif
 	while (1) {
 		ssize_t count = read(tun_fd, buf, BUFLEN);
 		if (count < 0) {
@@ -152,7 +307,7 @@ void *do_send(void *argument) {
 			return NULL;
 		}
 		pr("sending packet of length %ld... ", count);
-		fragment_and_send(radio, buf, count);
+		send_packet(buf, count);
 		pr("done\n");
 	}
 }
@@ -187,11 +342,31 @@ int main() {
 
 	pr("opened tun interface: %d\n", tun_fd);
 
+	/* before the receiver, which may hand them a packet as soon as it runs */
+#if SPLIT_TCP
+	pep_init(send_packet);
+#endif
+#if CHANNEL_MANAGER
+	chan_init(send_packet);
+#endif
+
 	pthread_t sender, receiver;
 
 	res = pthread_create(&sender, NULL, do_send, &tun_fd);
 	sleep(1); // prevent race condition
+#if TDMA
+	res |= pthread_create(&receiver, NULL, do_tdma, &tun_fd);
+#else
 	res |= pthread_create(&receiver, NULL, do_receive, &tun_fd);
+#endif
+#if SPLIT_TCP
+	pthread_t proxy;
+	res |= pthread_create(&proxy, NULL, pep_listen, NULL);
+#endif
+#if CHANNEL_MANAGER
+	pthread_t manager;
+	res |= pthread_create(&manager, NULL, chan_run, NULL);
+#endif
 	assert(!res);
 
 	res = pthread_join(sender, NULL);